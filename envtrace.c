@@ -0,0 +1,469 @@
+// Env latency trace
+// Copyright (c) 2021 Adrian Kennard, Andrews & Arnold Limited, see LICENSE file (GPL)
+// Consumes readings published by Env devices with the "trace" setting, and reports latency per stage and lost readings
+// Each traced reading is "value seq boot acquired fw read damp hold" (boot is hex id per boot, acquired as unix seconds, others in uS)
+// Clocks on devices and this host need to be NTP synced for the mqtt stage to mean anything
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <err.h>
+#include <time.h>
+#include <math.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <popt.h>
+#include <mosquitto.h>
+#include <sqllib.h>
+
+int debug = 0;
+const char *mqtthostname = "localhost";
+int mqttport = 1883;
+const char *mqttusername = NULL;
+const char *mqttpassword = NULL;
+const char *mqtttopic = "info/Env/#";
+int nosql = 0;
+const char *sqlconffile = NULL;
+const char *sqlhostname = NULL;
+const char *sqlusername = NULL;
+const char *sqlpassword = NULL;
+const char *sqldatabase = "env";
+const char *sqltable = "env";
+int sqlpoll = 100;              // ms
+int sqltimeout = 10;            // s
+int interval = 60;              // s
+
+static SQL sql;
+static volatile int done = 0;
+
+static int64_t now_us(void)
+{
+   struct timeval tv;
+   gettimeofday(&tv, NULL);
+   return (int64_t) tv.tv_sec * 1000000LL + tv.tv_usec;
+}
+
+#define stages	\
+	st(read,"Sample available to read (SCD30 half poll gap, DS18B20 conversion)")	\
+	st(damp,"Damping filter lag (model estimate, not in total)")	\
+	st(hold,"Held in rounding/hysteresis band")	\
+	st(fw,"Read to publish by device")	\
+	st(mqtt,"Publish to receipt via broker")	\
+	st(db,"Receipt to row seen in database")	\
+	st(broker,"Total to broker, all readings, excludes damping")	\
+	st(total,"Total to database row, excludes damping")	\
+	st(damped,"Total to database row plus damping estimate")	\
+
+enum
+{
+#define st(n,d) STAGE_##n,
+   stages
+#undef st
+   STAGES
+};
+
+#define	PERDECADE	20      // Histogram buckets per decade, so percentiles are within 12%
+#define	BUCKETS		(PERDECADE*10+1)        // Up to 10^10uS, bucket 0 is up to 1uS
+
+typedef struct stat_s
+{                               // Log histogram (uS) for one stage, fixed size however long we run
+   unsigned int bucket[BUCKETS];
+   unsigned int count;
+   int64_t min;
+   int64_t max;
+} stat_t;
+static stat_t stats[STAGES] = { 0 };    // This interval
+static stat_t cumulative[STAGES] = { 0 };       // Since start
+
+static void stat_one(stat_t * t, int64_t us)
+{
+   int b = (us <= 1 ? 0 : ceil(log10(us) * PERDECADE));
+   if (b >= BUCKETS)
+      b = BUCKETS - 1;
+   t->bucket[b]++;
+   if (!t->count || us < t->min)
+      t->min = us;
+   if (!t->count || us > t->max)
+      t->max = us;
+   t->count++;
+}
+
+static void stat_add(int s, int64_t us)
+{
+   if (us < 0)
+      us = 0;
+   stat_one(&stats[s], us);
+   stat_one(&cumulative[s], us);
+}
+
+static double stat_pc(stat_t * t, int pc)
+{                               // Percentile in ms, as upper bound of bucket
+   unsigned int want = (t->count * pc + 99) / 100,
+       n = 0;
+   if (!want)
+      return t->min / 1000.0;
+   int b;
+   for (b = 0; b < BUCKETS - 1 && (n += t->bucket[b]) < want; b++);
+   double us = pow(10, (double) b / PERDECADE);
+   if (us > t->max)
+      us = t->max;
+   if (us < t->min)
+      us = t->min;
+   return us / 1000.0;
+}
+
+typedef struct device_s device_t;
+struct device_s
+{                               // Sequence tracking per device
+   device_t *next;
+   char *id;
+   uint32_t boot;               // Boot id seq is for
+   uint32_t seq;                // Highest seq seen
+   unsigned int readings;       // Readings received
+   unsigned int lost;           // Missing sequence numbers (not yet arrived)
+   unsigned int late;           // Arrived out of order
+   unsigned int restarts;       // Sequence went back to start
+};
+static device_t *devices = NULL;
+
+static device_t *find_device(const char *id)
+{
+   device_t *d;
+   for (d = devices; d && strcmp(d->id, id); d = d->next);
+   if (!d)
+   {
+      d = calloc(1, sizeof(*d));
+      if (!d)
+         errx(1, "malloc");
+      d->id = strdup(id);
+      d->next = devices;
+      devices = d;
+   }
+   return d;
+}
+
+typedef struct pending_s pending_t;
+struct pending_s
+{                               // Reading waiting to be seen in database
+   pending_t *next;
+   device_t *device;
+   const char *col;             // Database column
+   double value;
+   int64_t published;           // uS
+   int64_t received;            // uS
+   int64_t seen;                // uS
+   char checked;                // Row with column set checked this poll
+   int64_t partial;             // Total so far, uS, -1 if transit unknown
+   int64_t damp;                // Damping estimate, uS
+};
+static pending_t *pending = NULL;
+
+static unsigned int untraced = 0;       // Readings without trace data
+static unsigned int unstored = 0;       // Readings not seen in database in time
+static unsigned int skew = 0;   // Readings received before they were published, or implausibly late (clocks not in sync)
+static unsigned int noclock = 0;        // Readings from device with clock not set
+
+static void mqtt_connect(struct mosquitto *mqtt, void *obj, int rc)
+{
+   obj = obj;
+   if (rc)
+      warnx("MQTT connect failed %s", mosquitto_connack_string(rc));
+   else
+      mosquitto_subscribe(mqtt, NULL, mqtttopic, 0);
+}
+
+static void message(struct mosquitto *mqtt, void *obj, const struct mosquitto_message *msg)
+{
+   mqtt = mqtt;
+   obj = obj;
+   int64_t rx = now_us();
+   // Topic is prefix/app/device/tag
+   char *topic = strdupa(msg->topic);
+   char *tag = strrchr(topic, '/');
+   if (!tag)
+      return;
+   *tag++ = 0;
+   char *id = strrchr(topic, '/');
+   if (!id)
+      return;
+   id++;
+   char *payload = strndupa(msg->payload, msg->payloadlen);
+   double value;
+   uint32_t seq,
+    boot;
+   long long sec,
+    usec,
+    fw,
+    hold;
+   unsigned int read,
+    damp;
+   if (sscanf(payload, "%lf %u %x %lld.%6lld %lld %u %u %lld", &value, &seq, &boot, &sec, &usec, &fw, &read, &damp, &hold) != 9)
+   {
+      if (debug)
+         warnx("Untraced %s/%s: %s", id, tag, payload);
+      untraced++;
+      return;
+   }
+   device_t *d = find_device(id);
+   d->readings++;
+   if (d->readings > 1 && boot != d->boot)
+   {                            // Device restarted, seq starts again (first readings may not have got through)
+      d->restarts++;
+      d->seq = 0;
+   }
+   d->boot = boot;
+   if (seq > d->seq)
+   {
+      d->lost += seq - d->seq - 1;
+      d->seq = seq;
+   } else if (d->lost)
+   {                            // Late arrival of one we counted as lost
+      d->lost--;
+      d->late++;
+   }
+   int64_t published = sec * 1000000LL + usec + fw;
+   int64_t transit = rx - published;
+   if (!sec)
+   {                            // Device clock not set
+      noclock++;
+      transit = -1;
+   } else if (transit < 0 || transit > sqltimeout * 1000000LL)
+   {
+      skew++;
+      transit = -1;
+   }
+   if (debug)
+      warnx("%s/%s %g seq=%u read=%u damp=%u hold=%lld fw=%lld mqtt=%lld", id, tag, value, seq, read, damp, hold, fw, (long long) transit);
+   if (read)
+      stat_add(STAGE_read, read);       // 0 is unknown
+   stat_add(STAGE_damp, damp);
+   stat_add(STAGE_hold, hold);
+   stat_add(STAGE_fw, fw);
+   int64_t partial = -1;
+   if (transit >= 0)
+   {                            // Skewed or unknown transit only counted, they would distort mqtt and total
+      stat_add(STAGE_mqtt, transit);
+      partial = read + hold + fw + transit;     // damp is only an estimate, and lag before hold starts, so separate
+      stat_add(STAGE_broker, partial);
+   }
+   const char *col = NULL;
+   if (!strcmp(tag, "co2"))
+      col = "co2";
+   else if (!strcmp(tag, "rh"))
+      col = "rh";
+   else if (!strcmp(tag, "temp"))
+      col = "temp";
+   if (!col || nosql)
+      return;                   // Not going to database
+   pending_t *p = calloc(1, sizeof(*p));
+   if (!p)
+      errx(1, "malloc");
+   p->device = d;
+   p->col = col;
+   p->value = value;
+   p->published = published;
+   p->received = rx;
+   p->partial = partial;
+   p->damp = damp;
+   p->next = pending;
+   pending = p;
+}
+
+static void db_poll(void)
+{                               // Look for pending readings in database, `when` only has 1 second resolution
+   // `when` is assigned downstream, so rows from receipt on, and only the first with this column set is checked,
+   // a later row could just have the same value again
+   int64_t now = now_us();
+   for (device_t *d = devices; d; d = d->next)
+   {
+      int64_t from = 0;
+      for (pending_t *p = pending; p; p = p->next)
+         if (p->device == d && !p->seen && (!from || p->received < from))
+            from = p->received;
+      if (!from)
+         continue;
+      SQL_RES *res = sql_safe_query_store_free(&sql, sql_printf("SELECT UNIX_TIMESTAMP(`when`) AS `t`,`co2`,`rh`,`temp` FROM `%#S` WHERE `tag`=%#s AND `when`>=FROM_UNIXTIME(%lld) ORDER BY `when`", sqltable, d->id, (long long) (from / 1000000LL)));
+      for (pending_t *p = pending; p; p = p->next)
+         p->checked = 0;
+      while (sql_fetch_row(res))
+      {
+         long long t = strtoll(sql_colz(res, "t"), NULL, 10);
+         for (pending_t *p = pending; p; p = p->next)
+            if (p->device == d && !p->seen && !p->checked && t >= p->received / 1000000LL)
+            {                   // Row may still be updated this second, so not matching is checked again next poll
+               const char *v = sql_col(res, p->col);
+               if (!v)
+                  continue;     // Row from other readings
+               p->checked = 1;
+               if (fabs(strtod(v, NULL) - p->value) < 0.051)     // temp column is only 0.1 resolution
+                  p->seen = now;
+            }
+      }
+      sql_free_result(res);
+   }
+   pending_t **pp = &pending;
+   while (*pp)
+   {
+      pending_t *p = *pp;
+      if (p->seen)
+      {
+         int64_t db = p->seen - p->received;
+         stat_add(STAGE_db, db);
+         if (p->partial >= 0)
+         {
+            stat_add(STAGE_total, p->partial + db);
+            stat_add(STAGE_damped, p->partial + db + p->damp);
+         }
+      } else if (p->received + sqltimeout * 1000000LL < now)
+         unstored++;
+      else
+      {
+         pp = &p->next;
+         continue;
+      }
+      *pp = p->next;
+      free(p);
+   }
+}
+
+static void report(const char *title, stat_t * stat)
+{
+   time_t now = time(0);
+   char when[30];
+   strftime(when, sizeof(when), "%F %T", localtime(&now));
+   printf("%s %s\n%-7s %8s %10s %10s %10s %10s %10s  ms\n", when, title, "Stage", "Count", "Min", "p50", "p90", "p99", "Max");
+   for (int s = 0; s < STAGES; s++)
+   {
+      stat_t *t = &stat[s];
+      if (!t->count)
+         continue;
+      double p(int pc) {
+         return stat_pc(t, pc);
+      }
+      const char *names[] = {
+#define st(n,d) #n,
+         stages
+#undef st
+      };
+      const char *descs[] = {
+#define st(n,d) d,
+         stages
+#undef st
+      };
+      printf("%-7s %8u %10.1f %10.1f %10.1f %10.1f %10.1f  %s\n", names[s], t->count, p(0), p(50), p(90), p(99), p(100), descs[s]);
+   }
+   printf("Percentiles within %.0f%%, counts below are since start\n", (pow(10, 1.0 / PERDECADE) - 1) * 100);
+   if (!nosql)
+      printf("db is measured at --sql-poll resolution, %dms\n", sqlpoll);
+   printf("%-20s %8s %8s %8s %8s\n", "Device", "Readings", "Lost", "Late", "Restarts");
+   for (device_t *d = devices; d; d = d->next)
+      printf("%-20s %8u %8u %8u %8u\n", d->id, d->readings, d->lost, d->late, d->restarts);
+   if (untraced)
+      printf("Untraced readings (trace setting not on): %u\n", untraced);
+   if (unstored)
+      printf("Readings not seen in database within %ds: %u\n", sqltimeout, unstored);
+   if (skew)
+      printf("Readings received before published or over %ds after, not in mqtt or total (clocks not synced): %u\n", sqltimeout, skew);
+   if (noclock)
+      printf("Readings from device without clock set, not in mqtt or total: %u\n", noclock);
+   printf("\n");
+   fflush(stdout);
+}
+
+static void stop(int s)
+{
+   s = s;
+   done = 1;
+}
+
+int main(int argc, const char *argv[])
+{
+   {                            // POPT
+      poptContext optCon;       // context for parsing command-line options
+      const struct poptOption optionsTable[] = {
+         {"mqtt-hostname", 'h', POPT_ARG_STRING | POPT_ARGFLAG_SHOW_DEFAULT, &mqtthostname, 0, "MQTT hostname", "hostname"},
+         {"mqtt-port", 0, POPT_ARG_INT | POPT_ARGFLAG_SHOW_DEFAULT, &mqttport, 0, "MQTT port", "port"},
+         {"mqtt-username", 'u', POPT_ARG_STRING, &mqttusername, 0, "MQTT username", "username"},
+         {"mqtt-password", 'p', POPT_ARG_STRING, &mqttpassword, 0, "MQTT password", "password"},
+         {"mqtt-topic", 't', POPT_ARG_STRING | POPT_ARGFLAG_SHOW_DEFAULT, &mqtttopic, 0, "MQTT topic", "topic"},
+         {"no-sql", 0, POPT_ARG_NONE, &nosql, 0, "Do not check database"},
+         {"sql-conffile", 'c', POPT_ARG_STRING, &sqlconffile, 0, "SQL conf file", "filename"},
+         {"sql-hostname", 'H', POPT_ARG_STRING, &sqlhostname, 0, "SQL hostname", "hostname"},
+         {"sql-username", 'U', POPT_ARG_STRING, &sqlusername, 0, "SQL username", "name"},
+         {"sql-password", 'P', POPT_ARG_STRING, &sqlpassword, 0, "SQL password", "pass"},
+         {"sql-database", 'd', POPT_ARG_STRING | POPT_ARGFLAG_SHOW_DEFAULT, &sqldatabase, 0, "SQL database", "db"},
+         {"sql-table", 'T', POPT_ARG_STRING | POPT_ARGFLAG_SHOW_DEFAULT, &sqltable, 0, "SQL table", "table"},
+         {"sql-poll", 0, POPT_ARG_INT | POPT_ARGFLAG_SHOW_DEFAULT, &sqlpoll, 0, "SQL poll interval", "ms"},
+         {"sql-timeout", 0, POPT_ARG_INT | POPT_ARGFLAG_SHOW_DEFAULT, &sqltimeout, 0, "Give up waiting for row", "s"},
+         {"interval", 'i', POPT_ARG_INT | POPT_ARGFLAG_SHOW_DEFAULT, &interval, 0, "Report interval (0 for only at end)", "s"},
+         {"debug", 'v', POPT_ARG_NONE, &debug, 0, "Debug"},
+         POPT_AUTOHELP {}
+      };
+
+      optCon = poptGetContext(NULL, argc, argv, optionsTable, 0);
+      //poptSetOtherOptionHelp (optCon, "");
+
+      int c;
+      if ((c = poptGetNextOpt(optCon)) < -1)
+         errx(1, "%s: %s\n", poptBadOption(optCon, POPT_BADOPTION_NOALIAS), poptStrerror(c));
+
+      if (poptPeekArg(optCon))
+      {
+         poptPrintUsage(optCon, stderr, 0);
+         return -1;
+      }
+      poptFreeContext(optCon);
+   }
+   if (sqlpoll <= 0)
+      sqlpoll = 100;
+   if (!nosql)
+      sql_real_connect(&sql, sqlhostname, sqlusername, sqlpassword, sqldatabase, 0, NULL, 0, 1, sqlconffile);
+   mosquitto_lib_init();
+   struct mosquitto *mqtt = mosquitto_new(NULL, 1, NULL);
+   if (!mqtt)
+      errx(1, "MQTT init failed");
+   if (mqttusername)
+      mosquitto_username_pw_set(mqtt, mqttusername, mqttpassword);
+   mosquitto_connect_callback_set(mqtt, mqtt_connect);
+   mosquitto_message_callback_set(mqtt, message);
+   int e = mosquitto_connect(mqtt, mqtthostname, mqttport, 60);
+   if (e)
+      errx(1, "MQTT connect failed (%s) %s", mqtthostname, mosquitto_strerror(e));
+   signal(SIGINT, stop);
+   signal(SIGTERM, stop);
+   int64_t nextpoll = 0,
+       nextreport = now_us() + interval * 1000000LL;
+   while (!done)
+   {                            // Single thread, so no locking needed between MQTT and SQL
+      e = mosquitto_loop(mqtt, sqlpoll, 1);
+      if (e && !done)
+      {
+         warnx("MQTT %s", mosquitto_strerror(e));
+         sleep(1);
+         mosquitto_reconnect(mqtt);
+      }
+      int64_t now = now_us();
+      if (!nosql && now >= nextpoll)
+      {
+         db_poll();
+         nextpoll = now + sqlpoll * 1000LL;
+      }
+      if (interval && now >= nextreport)
+      {
+         char title[50];
+         snprintf(title, sizeof(title), "last %ds", interval);
+         report(title, stats);
+         memset(stats, 0, sizeof(stats));
+         nextreport += interval * 1000000LL;
+      }
+   }
+   report("cumulative since start", cumulative);
+   mosquitto_destroy(mqtt);
+   mosquitto_lib_cleanup();
+   if (!nosql)
+      sql_close(&sql);
+   return 0;
+}
@@ -5,6 +5,8 @@ const char TAG[] = "CO2";
 #include "revk.h"
 #include <driver/i2c.h>
 #include <math.h>
+#include <sys/time.h>
+#include <esp_system.h>
 
 #include "owb.h"
 #include "owb_rmt.h"
@@ -42,6 +44,7 @@ const char TAG[] = "CO2";
 	u8(oledcontrast,127)	\
 	b(oledflip)	\
 	b(f)	\
+	b(trace)	\
 	s(fanon)	\
 	s(fanoff)	\
 	u32(fanco2,1000)	\
@@ -73,6 +76,12 @@ static int lastheat = -1;
 static float thisco2 = -10000;
 static float thistemp = -10000;
 static float thisrh = -10000;
+static int64_t heldco2 = 0;
+static int64_t heldrh = 0;
+static int64_t heldtemp = 0;
+static int64_t heldotemp = 0;
+static uint32_t traceseq = 0;
+static uint32_t traceboot = 0;  // Random per boot, so restarts are seen even if first readings are lost
 static int8_t co2port = -1;
 static int8_t num_owb = 0;
 static OneWireBus *owb = NULL;
@@ -85,9 +94,26 @@ static volatile uint8_t oled_dark = 0;
 
 static const char *co2_setting(uint16_t cmd, uint16_t val);
 
-static float report(const char *tag, float last, float this, int places)
+typedef struct
+{                               // Timing of the sample behind a reading, for trace
+   int64_t acquired;            // esp_timer time sample was read
+   uint32_t read;               // uS from sample being available (estimate) or conversion start to being read, 0 if unknown
+   uint32_t damp;               // uS estimated lag of damping filter
+} sample_t;
+
+static uint32_t damp_lag(uint32_t damp, int64_t interval)
+{                               // Mean lag of damping is damp samples, clamped to fit trace
+   int64_t lag = damp * interval;
+   return lag > UINT32_MAX ? UINT32_MAX : lag;
+}
+
+static float report(const char *tag, float last, float this, int places, int64_t * held, const sample_t * s)
 {
    float mag = powf(10.0, -places);     // Rounding
+   if (roundf(this / mag) * mag == last)
+      *held = 0;                // No change pending
+   else if (!*held)
+      *held = s->acquired;      // Change pending from this sample
    if (this < last)
    {
       this += mag * 0.3;        // Hysteresis
@@ -102,10 +128,24 @@ static float report(const char *tag, float last, float this, int places)
    this = roundf(this / mag) * mag;
    if (this == last)
       return last;
+   char v[20];
    if (places <= 0)
-      revk_info(tag, "%d", (int) this);
+      snprintf(v, sizeof(v), "%d", (int) this);
    else
-      revk_info(tag, "%.*f", places, this);
+      snprintf(v, sizeof(v), "%.*f", places, this);
+   if (trace)
+   {                            // value seq boot acquired(s) fw(uS) read(uS) damp(uS) hold(uS)
+      int64_t now = esp_timer_get_time();
+      struct timeval tv;
+      gettimeofday(&tv, NULL);
+      int64_t acq = (int64_t) tv.tv_sec * 1000000LL + tv.tv_usec - (now - s->acquired);
+      if (tv.tv_sec < 978307200)
+         acq = 0;               // Clock not set yet (before 2001)
+      uint32_t seq = __atomic_add_fetch(&traceseq, 1, __ATOMIC_RELAXED);        // Both sensor tasks report
+      revk_info(tag, "%s %u %08X %lld.%06lld %lld %u %u %lld", v, seq, traceboot, acq / 1000000LL, acq % 1000000LL, now - s->acquired, s->read, s->damp, s->acquired - *held);
+   } else
+      revk_info(tag, "%s", v);
+   *held = 0;
    return this;
 }
 
@@ -227,9 +267,13 @@ void co2_task(void *p)
       return;
    }
    // Get measurements
+   int64_t notready = 0;        // Previous poll, if it found no sample ready
+   int64_t lastready = 0;       // Previous sample
    while (1)
    {
       usleep(100000);
+      int64_t waiting = notready;       // Sample became ready since this, 0 if unknown (error, or just had one)
+      notready = 0;
       i2c_cmd_handle_t i = co2_cmd(0x0202);     // Get ready state
       i2c_master_stop(i);
       esp_err_t err = i2c_master_cmd_begin(co2port, i, 10 / portTICK_PERIOD_MS);
@@ -251,8 +295,13 @@ void co2_task(void *p)
             ESP_LOGI(TAG, "Rx GetReady %s", esp_err_to_name(err));
          else if (co2_crc(buf[0], buf[1]) != buf[2])
             ESP_LOGI(TAG, "Rx GetReady CRC error %02X %02X", co2_crc(buf[0], buf[1]), buf[2]);
-         else if ((buf[0] << 8) + buf[1] == 1)
+         else if ((buf[0] << 8) + buf[1] != 1)
+            notready = esp_timer_get_time();
+         else
          {
+            int64_t ready = esp_timer_get_time();
+            int64_t interval = (lastready ? ready - lastready : 0);
+            lastready = ready;
             i2c_cmd_handle_t i = co2_cmd(0x0300);       // Read data
             i2c_master_stop(i);
             esp_err_t err = i2c_master_cmd_begin(co2port, i, 10 / portTICK_PERIOD_MS);
@@ -311,10 +360,13 @@ void co2_task(void *p)
                      else
                         thisrh = (thisrh * rhdamp + rh) / (rhdamp + 1);
                   }
+                  sample_t s = {.acquired = ready,.read = (waiting ? (ready - waiting) / 2 : 0) };  // Ready at some point since last poll, so half on average
                   if (!num_owb && t >= -1000)
-                     lasttemp = report("temp", lasttemp, thistemp = t, tempplaces);     // Use temp here as no DS18B20
-                  lastco2 = report("co2", lastco2, thisco2, co2places);
-                  lastrh = report("rh", lastrh, thisrh, rhplaces);
+                     lasttemp = report("temp", lasttemp, thistemp = t, tempplaces, &heldtemp, &s);     // Use temp here as no DS18B20
+                  s.damp = damp_lag(co2damp, interval);
+                  lastco2 = report("co2", lastco2, thisco2, co2places, &heldco2, &s);
+                  s.damp = damp_lag(rhdamp, interval);
+                  lastrh = report("rh", lastrh, thisrh, rhplaces, &heldrh, &s);
                }
             }
          }
@@ -328,22 +380,26 @@ void ds18b20_task(void *p)
    while (1)
    {
       usleep(100000);
+      int64_t start = esp_timer_get_time();
       ds18b20_convert_all(owb);
       ds18b20_wait_for_conversion(ds18b20s[0]);
       float readings[MAX_OWB] = { 0 };
       DS18B20_ERROR errors[MAX_OWB] = { 0 };
       for (int i = 0; i < num_owb; ++i)
          errors[i] = ds18b20_read_temp(ds18b20s[i], &readings[i]);
+      int64_t now = esp_timer_get_time();
+      sample_t s = {.acquired = now,.read = now - start };
       if (!errors[0])
-         lasttemp = report("temp", lasttemp, thistemp = readings[0], tempplaces);       // Use temp here as no DS18B20
+         lasttemp = report("temp", lasttemp, thistemp = readings[0], tempplaces, &heldtemp, &s);        // Use temp here as no DS18B20
       if (num_owb > 1 && !errors[1])
-         lastotemp = report("otemp", lastotemp, readings[1], tempplaces);
+         lastotemp = report("otemp", lastotemp, readings[1], tempplaces, &heldotemp, &s);
    }
 }
 
 void app_main()
 {
    revk_init(&app_command);
+   traceboot = esp_random();
 #define b(n) revk_register(#n,0,sizeof(n),&n,NULL,SETTING_BOOLEAN);
 #define u32(n,d) revk_register(#n,0,sizeof(n),&n,#d,0);
 #define s8(n,d) revk_register(#n,0,sizeof(n),&n,#d,SETTING_SIGNED);